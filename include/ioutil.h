@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 void mkdir_safe(char *dir_name, int exist_ok) {
     struct stat st = {0};
@@ -18,6 +20,8 @@ void mkdir_safe(char *dir_name, int exist_ok) {
         return;
     }
     if(mkdir(dir_name, 0777) == -1) {
+        // Somebody else created it since the stat
+        if(errno == EEXIST && exist_ok) return;
         printf("ERROR -- Error creating directory %s\n", dir_name);
         exit(1);
     }
@@ -63,7 +67,7 @@ DIR *opendir_safe(char *dirname) {
 char *read_to_buffer(char *filepath) {
     FILE *file = open_safe(filepath, "r");
     struct stat statbuf;
-    if(stat(filepath, &statbuf) == -1) {
+    if(fstat(fileno(file), &statbuf) == -1) {
         printf("ERROR -- Error getting file status\n");
         exit(1);
     }
@@ -135,6 +139,79 @@ void parse_file_from_prefix(char *filepath, char *prefix, char *value) {
     exit(1);
 }
 
+// Rewrite a repository-relative path in place as its canonical form, with
+// empty and "." components dropped. ".." would escape the tree, so it is rejected.
+void normalize_path(char *path) {
+    char *out = path;
+    char *component = path;
+    while(*component) {
+        size_t len = strcspn(component, "/");
+        if(len == 2 && strncmp(component, "..", 2) == 0) {
+            printf("ERROR -- Path must not contain '..' components\n");
+            exit(1);
+        }
+        if(len > 0 && !(len == 1 && component[0] == '.')) {
+            if(out != path) *out++ = '/';
+            memmove(out, component, len);
+            out += len;
+        }
+        component += len;
+        if(*component == '/') component++;
+    }
+    *out = '\0';
+    if(out == path) {
+        printf("ERROR -- Path must name a file or directory\n");
+        exit(1);
+    }
+}
+
+// Lock files are created exclusively so only one writer can hold them at a time.
+// Returns NULL if somebody else already holds the lock.
+FILE *try_lock_file(char *lock_path) {
+    int fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if(fd == -1) {
+        if(errno == EEXIST) return NULL;
+        printf("ERROR -- Error creating lock file %s %s\n", lock_path, strerror(errno));
+        exit(1);
+    }
+    FILE *lock = fdopen(fd, "w");
+    if(lock == NULL) {
+        printf("ERROR -- Error opening lock file %s %s\n", lock_path, strerror(errno));
+        exit(1);
+    }
+    return lock;
+}
+
+FILE *lock_file_safe(char *lock_path) {
+    FILE *lock = try_lock_file(lock_path);
+    if(lock == NULL) {
+        printf("ERROR -- Lock file %s exists, another tig process may be running\n", lock_path);
+        exit(1);
+    }
+    return lock;
+}
+
+// Flush the lock file to disk and rename it over path, so readers see either
+// the old or the new contents and never a partial write
+void commit_lock_file(FILE *lock, char *lock_path, char *path) {
+    if(fflush(lock) != 0 || fsync(fileno(lock)) != 0) {
+        printf("ERROR -- Error writing lock file %s\n", lock_path);
+        exit(1);
+    }
+    close_safe(lock);
+    if(rename(lock_path, path) == -1) {
+        printf("ERROR -- Error renaming %s to %s %s\n", lock_path, path, strerror(errno));
+        exit(1);
+    }
+}
+
+void rollback_lock_file(FILE *lock, char *lock_path) {
+    close_safe(lock);
+    if(remove(lock_path) != 0) {
+        printf("ERROR -- Error removing lock file %s\n", lock_path);
+    }
+}
+
 void generate_timestamp(char *buffer, size_t size) {
     time_t current_time;
     struct tm *time_info;
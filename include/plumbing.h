@@ -1,13 +1,94 @@
 #include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <utime.h>
 #include <openssl/evp.h>
 #include "ioutil.h"
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define REFS_DIR "tig/refs/"
+#define PACKED_REFS_PATH "tig/packed-refs"
+
+struct ref_entry {
+    char *name;
+    char value[41];
+};
+
+// Every loose object in the store, sorted by hash. An object's index in
+// hashes is its position in reachability bitmaps.
+struct object_list {
+    char (*hashes)[41];
+    int count;
+};
 
 void create_object_path(char *hash, char *path) {
    sprintf(path, "tig/objects/%c%c/%s", hash[0], hash[1], hash + 2); 
 }
 
+// A commit links to its "parent" commit and its "tree", a tree to each of
+// its entries by name
+struct object_link {
+    char type[16];
+    char hash[41];
+    char name[256];
+};
+
+// Read the links out of a commit or tree. A root commit has no parent link.
+// Commit headers end at the message line, which may contain anything.
+struct object_link *read_object_links(char *hash, char *type, int *num_links) {
+    size_t capacity = 16;
+    struct object_link *links = malloc(capacity * sizeof(struct object_link));
+    int is_commit = strcmp(type, "commit") == 0;
+    char path[128];
+    char line[512];
+    *num_links = 0;
+    create_object_path(hash, path);
+    FILE *object_file = open_safe(path, "r");
+    while(fgets(line, sizeof(line), object_file)) {
+        struct object_link link;
+        line[strcspn(line, "\n")] = '\0';
+        if(is_commit) {
+            if(strncmp(line, "message ", 8) == 0) break;
+            if(sscanf(line, "parent %40s", link.hash) == 1) {
+                if(strcmp(link.hash, "root") == 0) continue;
+                strcpy(link.type, "commit");
+                strcpy(link.name, "parent");
+            } else if(sscanf(line, "tree %40s", link.hash) == 1) {
+                strcpy(link.type, "tree");
+                strcpy(link.name, "tree");
+            } else {
+                continue;
+            }
+        } else if(sscanf(line, "%15s %40s %255s", link.type, link.hash, link.name) != 3) {
+            continue;
+        }
+        if(*num_links == capacity) {
+            capacity *= 2;
+            links = realloc(links, capacity * sizeof(struct object_link));
+        }
+        links[(*num_links)++] = link;
+    }
+    close_safe(object_file);
+    return links;
+}
+
+// Read a commit's parent, "root" if it has none, and tree
+void read_commit_links(char *commit_hash, char *parent_hash, char *tree_hash) {
+    int num_links;
+    struct object_link *links = read_object_links(commit_hash, "commit", &num_links);
+    strcpy(parent_hash, "root");
+    tree_hash[0] = '\0';
+    for(int i = 0; i < num_links; i++) {
+        if(strcmp(links[i].name, "parent") == 0) strcpy(parent_hash, links[i].hash);
+        else if(strcmp(links[i].name, "tree") == 0) strcpy(tree_hash, links[i].hash);
+    }
+    free(links);
+    if(tree_hash[0] == '\0') {
+        printf("ERROR -- Commit %s has no tree\n", commit_hash);
+        exit(1);
+    }
+}
+
 void write_config() {
     FILE *config = open_safe("tig/.tigconfig", "w");
     char name[64];
@@ -18,17 +99,239 @@ void write_config() {
     close_safe(config);
 }
 
-void write_ref(char *path, char *value) {
-    FILE *ref = open_safe(path, "w");
-    fprintf(ref, "%s\n", value);
-    close_safe(ref);
-}
-
 void read_ref(char *path, char *value, size_t value_sz) {
     FILE *f = open_safe(path, "r");
+    value[0] = '\0';
     if(fgets(value, value_sz, f) != NULL) {
         value[strcspn(value, "\n")] = '\0';
     }
+    close_safe(f);
+}
+
+// packed-refs holds one "<value> <name>" line per ref, sorted by name, so a
+// single ref can be found by binary searching the mapped file
+int lookup_packed_ref(char *name, char *value, size_t value_sz) {
+    int fd = open(PACKED_REFS_PATH, O_RDONLY);
+    if(fd == -1) return 0;
+    struct stat statbuf;
+    if(fstat(fd, &statbuf) == -1 || statbuf.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    size_t size = statbuf.st_size;
+    char *buffer = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(buffer == MAP_FAILED) {
+        printf("ERROR -- Error mapping %s\n", PACKED_REFS_PATH);
+        exit(1);
+    }
+    int found = 0;
+    size_t name_len = strlen(name);
+    size_t lo = 0, hi = size;
+    while(lo < hi) {
+        size_t line = lo + (hi - lo) / 2;
+        while(line > lo && buffer[line - 1] != '\n') line--;
+        char *eol = memchr(buffer + line, '\n', size - line);
+        size_t line_end = eol ? eol - buffer : size;
+        char *sep = memchr(buffer + line, ' ', line_end - line);
+        if(sep == NULL) {
+            printf("ERROR -- Malformed line in %s\n", PACKED_REFS_PATH);
+            exit(1);
+        }
+        char *line_name = sep + 1;
+        size_t line_name_len = buffer + line_end - line_name;
+        int cmp = strncmp(name, line_name, line_name_len);
+        if(cmp == 0 && name_len != line_name_len) cmp = 1;
+        if(cmp == 0) {
+            size_t value_len = sep - (buffer + line);
+            if(value_len >= value_sz) value_len = value_sz - 1;
+            memcpy(value, buffer + line, value_len);
+            value[value_len] = '\0';
+            found = 1;
+            break;
+        } else if(cmp < 0) {
+            hi = line;
+        } else {
+            lo = line_end + 1;
+        }
+    }
+    munmap(buffer, size);
+    return found;
+}
+
+// Loose refs under tig/refs override whatever is recorded in packed-refs
+int resolve_ref(char *ref_path, char *value, size_t value_sz) {
+    value[0] = '\0';
+    FILE *f = fopen(ref_path, "r");
+    if(f != NULL) {
+        if(fgets(value, value_sz, f) != NULL) {
+            value[strcspn(value, "\n")] = '\0';
+        }
+        close_safe(f);
+        return 1;
+    }
+    size_t prefix_len = strlen(REFS_DIR);
+    if(strncmp(ref_path, REFS_DIR, prefix_len) != 0) return 0;
+    return lookup_packed_ref(ref_path + prefix_len, value, value_sz);
+}
+
+// Point ref_path at new_value under ref_path.lock. The update only goes through
+// if the ref still holds old_value; NULL skips the check and "" requires that
+// the ref does not exist yet.
+void update_ref(char *ref_path, char *new_value, char *old_value) {
+    char lock_path[strlen(ref_path) + 6];
+    sprintf(lock_path, "%s.lock", ref_path);
+    FILE *lock = lock_file_safe(lock_path);
+    if(old_value != NULL) {
+        char current_value[41];
+        resolve_ref(ref_path, current_value, sizeof(current_value));
+        if(strcmp(current_value, old_value) != 0) {
+            rollback_lock_file(lock, lock_path);
+            printf("ERROR -- Ref %s was updated concurrently (expected %s, found %s)\n", ref_path,
+                   *old_value ? old_value : "no ref", *current_value ? current_value : "no ref");
+            exit(1);
+        }
+    }
+    fprintf(lock, "%s\n", new_value);
+    commit_lock_file(lock, lock_path, ref_path);
+}
+
+int compare_ref_entries(const void *a, const void *b) {
+    return strcmp(((struct ref_entry *)a)->name, ((struct ref_entry *)b)->name);
+}
+
+void free_refs(struct ref_entry *refs, int num_refs) {
+    for(int i = 0; i < num_refs; i++) {
+        free(refs[i].name);
+    }
+    free(refs);
+}
+
+// One pass of read_refs. Sets vanished if a loose ref disappeared between
+// readdir and opening it.
+struct ref_entry *read_refs_once(int *num_refs, int *vanished) {
+    size_t capacity = 64;
+    struct ref_entry *refs = malloc(capacity * sizeof(struct ref_entry));
+    *num_refs = 0;
+    if(access(PACKED_REFS_PATH, F_OK) != -1) {
+        char *packed = read_to_buffer(PACKED_REFS_PATH);
+        char *save;
+        for(char *line = strtok_r(packed, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+            char *name = strchr(line, ' ');
+            if(name == NULL) continue;
+            *name++ = '\0';
+            if(*num_refs == capacity) {
+                capacity *= 2;
+                refs = realloc(refs, capacity * sizeof(struct ref_entry));
+            }
+            refs[*num_refs].name = strdup(name);
+            snprintf(refs[*num_refs].value, sizeof(refs[*num_refs].value), "%s", line);
+            (*num_refs)++;
+        }
+        free(packed);
+    }
+    int num_packed = *num_refs;
+    int sorted = 1;
+    struct dirent *files;
+    DIR *ref_dir = opendir_safe("tig/refs");
+    while(ref_dir && (files = readdir(ref_dir)) != NULL) {
+        size_t name_len = strlen(files->d_name);
+        if(strcmp(files->d_name, ".") == 0 || strcmp(files->d_name, "..") == 0) continue;
+        if(name_len > 5 && strcmp(files->d_name + name_len - 5, ".lock") == 0) continue;
+        char ref_path[strlen(REFS_DIR) + name_len + 1];
+        char value[41];
+        sprintf(ref_path, "%s%s", REFS_DIR, files->d_name);
+        FILE *f = fopen(ref_path, "r");
+        if(f == NULL) {
+            *vanished = 1;
+            continue;
+        }
+        value[0] = '\0';
+        if(fgets(value, sizeof(value), f) != NULL) {
+            value[strcspn(value, "\n")] = '\0';
+        }
+        close_safe(f);
+        struct ref_entry key = { files->d_name };
+        struct ref_entry *packed_ref = bsearch(&key, refs, num_packed, sizeof(struct ref_entry), compare_ref_entries);
+        if(packed_ref) {
+            strcpy(packed_ref->value, value);
+            continue;
+        }
+        if(*num_refs == capacity) {
+            capacity *= 2;
+            refs = realloc(refs, capacity * sizeof(struct ref_entry));
+        }
+        refs[*num_refs].name = strdup(files->d_name);
+        strcpy(refs[*num_refs].value, value);
+        (*num_refs)++;
+        sorted = 0;
+    }
+    if(ref_dir) closedir(ref_dir);
+    if(!sorted) qsort(refs, *num_refs, sizeof(struct ref_entry), compare_ref_entries);
+    return refs;
+}
+
+int same_file_version(struct stat *a, struct stat *b) {
+    return a->st_ino == b->st_ino && a->st_size == b->st_size && a->st_mtime == b->st_mtime && a->st_ctime == b->st_ctime;
+}
+
+// Returns every ref sorted by name. packed-refs is read in one go and loose
+// refs are merged over it. pack_refs renames a new packed-refs into place
+// before deleting the loose refs it packed, so if packed-refs changed or a
+// loose ref vanished mid-read, that ref may only be in the new file: read
+// again. gc builds its roots from here, so a dropped ref would lose objects.
+struct ref_entry *read_refs(int *num_refs) {
+    while(1) {
+        struct stat before, after;
+        int vanished = 0;
+        int had_packed = stat(PACKED_REFS_PATH, &before) == 0;
+        struct ref_entry *refs = read_refs_once(num_refs, &vanished);
+        int has_packed = stat(PACKED_REFS_PATH, &after) == 0;
+        if(!vanished && had_packed == has_packed && (!has_packed || same_file_version(&before, &after))) {
+            return refs;
+        }
+        free_refs(refs, *num_refs);
+    }
+}
+
+// Fold all loose refs into packed-refs, then drop the loose files that still
+// match what was packed
+void pack_refs() {
+    char *lock_path = PACKED_REFS_PATH ".lock";
+    FILE *lock = lock_file_safe(lock_path);
+    int num_refs;
+    struct ref_entry *refs = read_refs(&num_refs);
+    for(int i = 0; i < num_refs; i++) {
+        fprintf(lock, "%s %s\n", refs[i].value, refs[i].name);
+    }
+    commit_lock_file(lock, lock_path, PACKED_REFS_PATH);
+    for(int i = 0; i < num_refs; i++) {
+        char ref_path[strlen(REFS_DIR) + strlen(refs[i].name) + 1];
+        char ref_lock_path[sizeof(ref_path) + 5];
+        char value[41];
+        sprintf(ref_path, "%s%s", REFS_DIR, refs[i].name);
+        sprintf(ref_lock_path, "%s.lock", ref_path);
+        if(access(ref_path, F_OK) == -1) continue;
+        // Skip refs that are being updated, the loose value will win anyway
+        FILE *ref_lock = try_lock_file(ref_lock_path);
+        if(ref_lock == NULL) continue;
+        read_ref(ref_path, value, sizeof(value));
+        if(strcmp(value, refs[i].value) == 0 && remove(ref_path) != 0) {
+            printf("ERROR -- Error removing loose ref %s\n", ref_path);
+        }
+        rollback_lock_file(ref_lock, ref_lock_path);
+    }
+    printf("INFO -- Packed %d refs\n", num_refs);
+    free_refs(refs, num_refs);
+}
+
+void hash_to_hex(unsigned char *hash, unsigned int length, char *output) {
+    char *digits = "0123456789abcdef";
+    for (unsigned int i = 0; i < length; ++i) {
+        output[i * 2] = digits[hash[i] >> 4];
+        output[i * 2 + 1] = digits[hash[i] & 0xf];
+    }
+    output[length * 2] = '\0';
 }
 
 void sha1(char *input, char *output) {
@@ -52,10 +355,7 @@ void sha1(char *input, char *output) {
         exit(1);
     }
     EVP_MD_CTX_free(mdctx);
-    for (unsigned int i = 0; i < length; ++i) {
-        sprintf(output + (i * 2), "%02x", hash[i]);
-    }
-    output[length * 2] = '\0';
+    hash_to_hex(hash, length, output);
 }
 
 
@@ -70,11 +370,21 @@ void write_object(char *type, char *file_content, char *hash_to_create) {
     sprintf(dirpath, "tig/objects/%c%c", hash_to_create[0], hash_to_create[1]);
     mkdir_safe(dirpath, 1);
     sprintf(filepath, "%s/%s", dirpath, hash_to_create + 2);
-    if(access(filepath, F_OK) != -1) {
+    // Freshen an existing object so gc treats it as new while it gets
+    // referenced again. If gc already pruned it, write it out again below.
+    if(utime(filepath, NULL) == 0) {
         printf("INFO -- Object file already exists %s\n", filepath);
         return;
     }
-    FILE *object_file = open_safe(filepath, "w");
+    // gc --repack may remove the fan-out directory between mkdir and open
+    errno = 0;
+    FILE *object_file = fopen(filepath, "w");
+    for(int attempt = 0; object_file == NULL && errno == ENOENT && attempt < 3; attempt++) {
+        mkdir_safe(dirpath, 1);
+        errno = 0;
+        object_file = fopen(filepath, "w");
+    }
+    if(object_file == NULL) object_file = open_safe(filepath, "w");
     fputs(file_content, object_file);
     close_safe(object_file);
 }
@@ -164,6 +474,353 @@ void write_work_directory(char *tree_hash, char *basepath) {
     close_safe(tree_file);
 }
 
+int compare_object_hashes(const void *a, const void *b) {
+    return strcmp((char *)a, (char *)b);
+}
+
+void list_objects(struct object_list *objects) {
+    size_t capacity = 1024;
+    objects->hashes = malloc(capacity * sizeof(*objects->hashes));
+    objects->count = 0;
+    struct dirent *fanout;
+    DIR *objects_dir = opendir_safe("tig/objects");
+    if(objects_dir == NULL) exit(1);
+    while((fanout = readdir(objects_dir)) != NULL) {
+        if(strlen(fanout->d_name) != 2 || fanout->d_name[0] == '.') continue;
+        char dirpath[32];
+        sprintf(dirpath, "tig/objects/%.2s", fanout->d_name);
+        DIR *dir = opendir_safe(dirpath);
+        if(dir == NULL) continue;
+        struct dirent *files;
+        while((files = readdir(dir)) != NULL) {
+            if(strlen(files->d_name) != 38) continue;
+            if(objects->count == capacity) {
+                capacity *= 2;
+                objects->hashes = realloc(objects->hashes, capacity * sizeof(*objects->hashes));
+            }
+            sprintf(objects->hashes[objects->count++], "%s%s", fanout->d_name, files->d_name);
+        }
+        closedir(dir);
+    }
+    closedir(objects_dir);
+    qsort(objects->hashes, objects->count, sizeof(*objects->hashes), compare_object_hashes);
+}
+
+int find_object_position(struct object_list *objects, char *hash) {
+    char (*found)[41] = bsearch(hash, objects->hashes, objects->count, sizeof(*objects->hashes), compare_object_hashes);
+    return found ? found - objects->hashes : -1;
+}
+
+void free_object_list(struct object_list *objects) {
+    free(objects->hashes);
+    objects->hashes = NULL;
+    objects->count = 0;
+}
+
+#define BITMAP_WORD_BITS (8 * sizeof(unsigned long))
+
+unsigned long *bitmap_new(int num_bits) {
+    unsigned long *bitmap = calloc(num_bits / BITMAP_WORD_BITS + 1, sizeof(unsigned long));
+    if(bitmap == NULL) {
+        printf("ERROR -- Error allocating bitmap\n");
+        exit(1);
+    }
+    return bitmap;
+}
+
+int bitmap_test(unsigned long *bitmap, int pos) {
+    return (bitmap[pos / BITMAP_WORD_BITS] >> (pos % BITMAP_WORD_BITS)) & 1;
+}
+
+// Returns the previous value of the bit, so exactly one thread wins each object
+int bitmap_test_and_set(unsigned long *bitmap, int pos) {
+    unsigned long mask = 1UL << (pos % BITMAP_WORD_BITS);
+    return (__atomic_fetch_or(&bitmap[pos / BITMAP_WORD_BITS], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+int worker_count() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+// Objects don't record their type on disk, so verification has to work it out
+char *object_types[] = { "blob", "tree", "commit", "patch" };
+#define NUM_OBJECT_TYPES (sizeof(object_types) / sizeof(object_types[0]))
+#define VERIFY_CHUNK_SIZE 65536
+
+// Guess an object's type from its first bytes. Commits start with their
+// parent header and trees with a "blob|tree <hash> " entry. Patches look like
+// arbitrary text, so they are guessed as blobs and found by the fallback.
+char *guess_object_type(char *chunk, size_t bytes) {
+    if(bytes >= 7 && memcmp(chunk, "parent ", 7) == 0) return "commit";
+    if(bytes >= 46 && (memcmp(chunk, "blob ", 5) == 0 || memcmp(chunk, "tree ", 5) == 0) && chunk[45] == ' ') {
+        int hex = 1;
+        for(int i = 5; i < 45 && hex; i++) {
+            hex = (chunk[i] >= '0' && chunk[i] <= '9') || (chunk[i] >= 'a' && chunk[i] <= 'f');
+        }
+        if(hex) return "tree";
+    }
+    return "blob";
+}
+
+// Hash an object file, whose first chunk is already read, once for each of
+// types. Returns the index of the type whose hash matches, or -1.
+int hash_object_stream(FILE *object_file, char *chunk, size_t bytes, size_t object_size,
+                       char **types, int num_types, char *hash) {
+    EVP_MD_CTX *mdctx[num_types];
+    for(int i = 0; i < num_types; i++) {
+        char header[32];
+        int header_len = sprintf(header, "%s %zu ", types[i], object_size);
+        mdctx[i] = EVP_MD_CTX_new();
+        if(mdctx[i] == NULL || EVP_DigestInit_ex(mdctx[i], EVP_sha1(), NULL) != 1
+           || EVP_DigestUpdate(mdctx[i], header, header_len) != 1) {
+            printf("ERROR -- Error initializing digest\n");
+            exit(1);
+        }
+    }
+    do {
+        for(int i = 0; i < num_types; i++) {
+            if(EVP_DigestUpdate(mdctx[i], chunk, bytes) != 1) {
+                printf("ERROR -- Error updating digest\n");
+                exit(1);
+            }
+        }
+    } while((bytes = fread(chunk, 1, VERIFY_CHUNK_SIZE, object_file)) > 0);
+    int match = -1;
+    for(int i = 0; i < num_types; i++) {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int length = 0;
+        char digest_hex[2 * EVP_MAX_MD_SIZE + 1];
+        if(EVP_DigestFinal_ex(mdctx[i], digest, &length) != 1) {
+            printf("ERROR -- Error finalizing digest\n");
+            exit(1);
+        }
+        EVP_MD_CTX_free(mdctx[i]);
+        hash_to_hex(digest, length, digest_hex);
+        if(strcmp(digest_hex, hash) == 0) match = i;
+    }
+    return match;
+}
+
+// Rehash an object file in fixed-size chunks so memory stays flat however
+// large it is. Only the type guessed from the first chunk is hashed; the
+// other types are tried on a second read only if that doesn't match, which
+// normally means the object is corrupt. Returns the type whose hash matches
+// the file name, or NULL if none does.
+char *verify_object(char *hash, size_t *object_size) {
+    char path[128];
+    struct stat statbuf;
+    create_object_path(hash, path);
+    *object_size = 0;
+    FILE *object_file = fopen(path, "r");
+    if(object_file == NULL) return NULL;
+    if(fstat(fileno(object_file), &statbuf) == -1) {
+        close_safe(object_file);
+        return NULL;
+    }
+    *object_size = statbuf.st_size;
+    char *chunk = malloc(VERIFY_CHUNK_SIZE);
+    size_t bytes = fread(chunk, 1, VERIFY_CHUNK_SIZE, object_file);
+    char *type = guess_object_type(chunk, bytes);
+    if(hash_object_stream(object_file, chunk, bytes, *object_size, &type, 1, hash) == -1) {
+        char *other_types[NUM_OBJECT_TYPES];
+        int num_other = 0;
+        for(int i = 0; i < NUM_OBJECT_TYPES; i++) {
+            if(strcmp(object_types[i], type) != 0) other_types[num_other++] = object_types[i];
+        }
+        rewind(object_file);
+        bytes = fread(chunk, 1, VERIFY_CHUNK_SIZE, object_file);
+        int match = hash_object_stream(object_file, chunk, bytes, *object_size, other_types, num_other, hash);
+        type = match == -1 ? NULL : other_types[match];
+    }
+    free(chunk);
+    close_safe(object_file);
+    return type;
+}
+
+// Report every object a commit or tree points at that is not in the store or
+// does not hash as the type the link claims. types holds the type verified for
+// each object position, NULL for corrupt objects which are reported already.
+int check_object_links(struct object_list *objects, char **types, char *hash, char *type) {
+    int problems = 0;
+    int num_links;
+    struct object_link *links = read_object_links(hash, type, &num_links);
+    for(int i = 0; i < num_links; i++) {
+        int pos = find_object_position(objects, links[i].hash);
+        if(pos == -1) {
+            printf("ERROR -- Dangling link from %s %s to %s %s\n", type, hash, links[i].type, links[i].hash);
+            problems++;
+        } else if(types[pos] && strcmp(types[pos], links[i].type) != 0) {
+            printf("ERROR -- Link from %s %s to %s %s is a %s\n", type, hash, links[i].type, links[i].hash, types[pos]);
+            problems++;
+        }
+    }
+    free(links);
+    return problems;
+}
+
+struct fsck_state {
+    struct object_list *objects;
+    char **types;
+    int next;
+    int problems;
+    size_t bytes;
+};
+
+void *fsck_verify_worker(void *arg) {
+    struct fsck_state *state = arg;
+    int i;
+    while((i = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED)) < state->objects->count) {
+        size_t object_size;
+        state->types[i] = verify_object(state->objects->hashes[i], &object_size);
+        __atomic_fetch_add(&state->bytes, object_size, __ATOMIC_RELAXED);
+        if(state->types[i] == NULL) {
+            printf("ERROR -- Object %s does not match its hash\n", state->objects->hashes[i]);
+            __atomic_fetch_add(&state->problems, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+void *fsck_link_worker(void *arg) {
+    struct fsck_state *state = arg;
+    int i;
+    while((i = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED)) < state->objects->count) {
+        char *type = state->types[i];
+        if(type && (strcmp(type, "commit") == 0 || strcmp(type, "tree") == 0)) {
+            int problems = check_object_links(state->objects, state->types, state->objects->hashes[i], type);
+            __atomic_fetch_add(&state->problems, problems, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+void run_fsck_workers(struct fsck_state *state, void *(*worker)(void *)) {
+    int num_workers = worker_count();
+    pthread_t workers[num_workers];
+    state->next = 0;
+    for(int i = 0; i < num_workers; i++) {
+        if(pthread_create(&workers[i], NULL, worker, state) != 0) {
+            printf("ERROR -- Error starting fsck thread\n");
+            exit(1);
+        }
+    }
+    for(int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+// Verify every object in the store on one thread per core, recording each
+// object's type in types, then check commit and tree links against those
+// types. Returns the number of problems found and the bytes read.
+int fsck_objects(struct object_list *objects, char **types, size_t *bytes) {
+    struct fsck_state state = { objects, types };
+    run_fsck_workers(&state, fsck_verify_worker);
+    run_fsck_workers(&state, fsck_link_worker);
+    *bytes = state.bytes;
+    return state.problems;
+}
+
+struct mark_item {
+    char type[16];
+    char hash[41];
+};
+
+struct mark_state {
+    struct object_list *objects;
+    unsigned long *bitmap;
+    struct mark_item *queue;
+    int queue_len;
+    int queue_cap;
+    int active;
+    int missing;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+void push_mark_item(struct mark_state *state, char *type, char *hash) {
+    pthread_mutex_lock(&state->lock);
+    if(state->queue_len == state->queue_cap) {
+        state->queue_cap = state->queue_cap ? state->queue_cap * 2 : 256;
+        state->queue = realloc(state->queue, state->queue_cap * sizeof(struct mark_item));
+    }
+    snprintf(state->queue[state->queue_len].type, sizeof(state->queue[0].type), "%s", type);
+    snprintf(state->queue[state->queue_len].hash, sizeof(state->queue[0].hash), "%s", hash);
+    state->queue_len++;
+    pthread_cond_signal(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+}
+
+// Set the object's bit and queue up everything it references
+void mark_object(struct mark_state *state, struct mark_item *item) {
+    int pos = find_object_position(state->objects, item->hash);
+    if(pos == -1) {
+        printf("WARNING -- Missing %s object %s\n", item->type, item->hash);
+        __atomic_fetch_add(&state->missing, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if(bitmap_test_and_set(state->bitmap, pos)) return;
+    if(strcmp(item->type, "commit") != 0 && strcmp(item->type, "tree") != 0) return;
+    int num_links;
+    struct object_link *links = read_object_links(item->hash, item->type, &num_links);
+    for(int i = 0; i < num_links; i++) {
+        push_mark_item(state, links[i].type, links[i].hash);
+    }
+    free(links);
+}
+
+void *mark_worker(void *arg) {
+    struct mark_state *state = arg;
+    struct mark_item item;
+    pthread_mutex_lock(&state->lock);
+    while(1) {
+        while(state->queue_len == 0 && state->active > 0) {
+            pthread_cond_wait(&state->cond, &state->lock);
+        }
+        // Nothing queued and nobody left to queue more, the walk is done
+        if(state->queue_len == 0) break;
+        item = state->queue[--state->queue_len];
+        state->active++;
+        pthread_mutex_unlock(&state->lock);
+        mark_object(state, &item);
+        pthread_mutex_lock(&state->lock);
+        state->active--;
+    }
+    pthread_cond_broadcast(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+// Walk the commit graph from every ref across all cores, setting the bitmap
+// bit of each reachable object. Returns the number of referenced objects that
+// are missing from the store.
+int mark_reachable_objects(struct object_list *objects, unsigned long *bitmap) {
+    struct mark_state state = { objects, bitmap };
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+    int num_refs;
+    struct ref_entry *refs = read_refs(&num_refs);
+    for(int i = 0; i < num_refs; i++) {
+        if(strcmp(refs[i].value, "root") != 0) push_mark_item(&state, "commit", refs[i].value);
+    }
+    free_refs(refs, num_refs);
+    int num_workers = worker_count();
+    pthread_t workers[num_workers];
+    for(int i = 0; i < num_workers; i++) {
+        if(pthread_create(&workers[i], NULL, mark_worker, &state) != 0) {
+            printf("ERROR -- Error starting mark thread\n");
+            exit(1);
+        }
+    }
+    for(int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&state.lock);
+    pthread_cond_destroy(&state.cond);
+    free(state.queue);
+    return state.missing;
+}
+
 void free_lcs(char **lcs, int index) {
     for(int i = 0; i < index; i++) {
         free(lcs[index]);
@@ -288,15 +945,6 @@ void file_diff(char *path1, char *path2, char *patch_hash, int apply) {
     if(apply) apply_file_diff(path1, patch_hash);
 }
 
-void tree_diff(char *hash1, char *hash2, char *patch_hash) {
-    char tree_path1[256];
-    char tree_path2[256];
-    int tree_n1;
-    int tree_n2;
-    create_object_path(hash1, tree_path1);
-    create_object_path(hash2, tree_path2);
-}
-
     
     // TODO -- Write function to show additions and deletions from Xn -> Yn with line numbers
     //int i = 0, j = 0, k = 0;
@@ -314,3 +962,450 @@ void tree_diff(char *hash1, char *hash2, char *patch_hash) {
             //k++;
         //}
     //}
+
+int compare_tree_entries(const void *a, const void *b) {
+    return strcmp(((struct object_link *)a)->name, ((struct object_link *)b)->name);
+}
+
+// Read a tree's entries sorted by name. A NULL hash is the empty tree.
+struct object_link *read_tree_entries(char *tree_hash, int *num_entries) {
+    if(tree_hash == NULL) {
+        *num_entries = 0;
+        return malloc(sizeof(struct object_link));
+    }
+    struct object_link *entries = read_object_links(tree_hash, "tree", num_entries);
+    qsort(entries, *num_entries, sizeof(struct object_link), compare_tree_entries);
+    return entries;
+}
+
+// Find the hash of the object at a slash separated path inside a tree
+int lookup_tree_path(char *tree_hash, char *path, char *target_hash) {
+    char components[strlen(path) + 1];
+    char current[41];
+    char *save;
+    strcpy(components, path);
+    strcpy(current, tree_hash);
+    char *name = strtok_r(components, "/", &save);
+    while(name) {
+        int num_entries;
+        struct object_link *entries = read_tree_entries(current, &num_entries);
+        struct object_link key;
+        snprintf(key.name, sizeof(key.name), "%s", name);
+        struct object_link *entry = bsearch(&key, entries, num_entries, sizeof(struct object_link), compare_tree_entries);
+        name = strtok_r(NULL, "/", &save);
+        int found = entry && (name == NULL || strcmp(entry->type, "tree") == 0);
+        if(found) strcpy(current, entry->hash);
+        free(entries);
+        if(!found) return 0;
+    }
+    strcpy(target_hash, current);
+    return 1;
+}
+
+#define BLOOM_BYTES 64
+#define BLOOM_HASHES 7
+// Past this many changed paths the filter is saturated and just says "maybe"
+#define BLOOM_MAX_PATHS 64
+
+struct path_bloom {
+    unsigned char bits[BLOOM_BYTES];
+    int num_paths;
+};
+
+void bloom_positions(char *path, unsigned int *positions) {
+    unsigned long long h = 14695981039346656037ULL;
+    for(unsigned char *c = (unsigned char *)path; *c; c++) {
+        h ^= *c;
+        h *= 1099511628211ULL;
+    }
+    unsigned int h1 = h;
+    unsigned int h2 = (h >> 32) | 1;
+    for(int i = 0; i < BLOOM_HASHES; i++) {
+        positions[i] = (h1 + i * h2) % (BLOOM_BYTES * 8);
+    }
+}
+
+void bloom_add(struct path_bloom *bloom, char *path) {
+    unsigned int positions[BLOOM_HASHES];
+    bloom_positions(path, positions);
+    for(int i = 0; i < BLOOM_HASHES; i++) {
+        bloom->bits[positions[i] / 8] |= 1 << (positions[i] % 8);
+    }
+    if(++bloom->num_paths > BLOOM_MAX_PATHS) memset(bloom->bits, 0xff, BLOOM_BYTES);
+}
+
+int bloom_maybe_contains(unsigned char *bits, char *path) {
+    unsigned int positions[BLOOM_HASHES];
+    bloom_positions(path, positions);
+    for(int i = 0; i < BLOOM_HASHES; i++) {
+        if(!(bits[positions[i] / 8] & (1 << (positions[i] % 8)))) return 0;
+    }
+    return 1;
+}
+
+// Walk two trees side by side and add every added, removed or modified path
+// to the bloom filter. Directories containing a change are added as well
+// since their own hash changes. A NULL hash is the empty tree.
+void tree_diff(char *old_tree, char *new_tree, char *prefix, struct path_bloom *bloom) {
+    int num_old, num_new;
+    struct object_link *old_entries = read_tree_entries(old_tree, &num_old);
+    struct object_link *new_entries = read_tree_entries(new_tree, &num_new);
+    int i = 0, j = 0;
+    while(i < num_old || j < num_new) {
+        int cmp;
+        if(i == num_old) cmp = 1;
+        else if(j == num_new) cmp = -1;
+        else cmp = strcmp(old_entries[i].name, new_entries[j].name);
+        struct object_link *old_entry = cmp <= 0 ? &old_entries[i++] : NULL;
+        struct object_link *new_entry = cmp >= 0 ? &new_entries[j++] : NULL;
+        if(old_entry && new_entry && strcmp(old_entry->hash, new_entry->hash) == 0) continue;
+        char path[strlen(prefix) + 257];
+        sprintf(path, "%s%s", prefix, old_entry ? old_entry->name : new_entry->name);
+        bloom_add(bloom, path);
+        if(bloom->num_paths > BLOOM_MAX_PATHS) break;
+        int old_is_tree = old_entry && strcmp(old_entry->type, "tree") == 0;
+        int new_is_tree = new_entry && strcmp(new_entry->type, "tree") == 0;
+        if(old_is_tree || new_is_tree) {
+            strcat(path, "/");
+            tree_diff(old_is_tree ? old_entry->hash : NULL, new_is_tree ? new_entry->hash : NULL, path, bloom);
+        }
+    }
+    free(old_entries);
+    free(new_entries);
+}
+
+int path_changed_in_commit(char *commit_hash, char *path) {
+    char parent_hash[41];
+    char grandparent_hash[41];
+    char tree_hash[41];
+    char new_hash[41];
+    char old_hash[41];
+    read_commit_links(commit_hash, parent_hash, tree_hash);
+    int in_new = lookup_tree_path(tree_hash, path, new_hash);
+    if(strcmp(parent_hash, "root") == 0) return in_new;
+    read_commit_links(parent_hash, grandparent_hash, tree_hash);
+    int in_old = lookup_tree_path(tree_hash, path, old_hash);
+    if(in_new != in_old) return 1;
+    return in_new && strcmp(new_hash, old_hash) != 0;
+}
+
+#define COMMIT_GRAPH_PATH "tig/commit-graph"
+#define COMMIT_GRAPH_MAGIC "TIGCG001"
+
+// tig/commit-graph caches each commit's parent and changed-path bloom filter
+// so path-limited history never opens commits the filter rules out. Records
+// are sorted by commit hash up to num_sorted; commits written since the last
+// refresh are appended unsorted after them. Sorted records also store their
+// parent's position, so a history walk through them is O(1) per commit.
+// Opening the graph sorts an index over the tail in O(T log T), after which
+// a tail commit costs two binary searches, O(log N + log T).
+struct commit_graph_header {
+    char magic[8];
+    unsigned int num_sorted;
+    unsigned int reserved;
+};
+
+#define COMMIT_GRAPH_NO_POSITION 0xffffffffU
+#define COMMIT_GRAPH_MAX_TAIL 1024
+
+struct commit_graph_record {
+    unsigned char commit[20];
+    unsigned char parent[20];
+    unsigned char bloom[BLOOM_BYTES];
+    // Index of the parent among the sorted records, or COMMIT_GRAPH_NO_POSITION
+    unsigned int parent_position;
+};
+
+struct commit_graph {
+    void *map;
+    size_t map_size;
+    struct commit_graph_record *records;
+    int num_sorted;
+    int num_records;
+    // The unsorted tail records, ordered by commit hash
+    struct commit_graph_record **tail;
+};
+
+int hex_digit(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return 0;
+}
+
+void hex_to_hash(char *hex, unsigned char *hash) {
+    for(int i = 0; i < 20; i++) {
+        hash[i] = hex_digit(hex[2 * i]) << 4 | hex_digit(hex[2 * i + 1]);
+    }
+}
+
+int compare_commit_graph_records(const void *a, const void *b) {
+    return memcmp(a, b, 20);
+}
+
+int compare_commit_graph_tail(const void *a, const void *b) {
+    return memcmp((*(struct commit_graph_record **)a)->commit, (*(struct commit_graph_record **)b)->commit, 20);
+}
+
+int compare_commit_graph_tail_key(const void *key, const void *record) {
+    return memcmp(key, (*(struct commit_graph_record **)record)->commit, 20);
+}
+
+// A missing or unreadable graph opens as empty, so callers fall back to
+// reading commit objects
+void open_commit_graph(struct commit_graph *graph) {
+    memset(graph, 0, sizeof(struct commit_graph));
+    int fd = open(COMMIT_GRAPH_PATH, O_RDONLY);
+    if(fd == -1) return;
+    struct stat statbuf;
+    if(fstat(fd, &statbuf) == -1 || statbuf.st_size < sizeof(struct commit_graph_header)) {
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return;
+    struct commit_graph_header *header = map;
+    int num_records = (statbuf.st_size - sizeof(struct commit_graph_header)) / sizeof(struct commit_graph_record);
+    if(memcmp(header->magic, COMMIT_GRAPH_MAGIC, 8) != 0 || header->num_sorted > num_records) {
+        printf("WARNING -- Ignoring malformed %s\n", COMMIT_GRAPH_PATH);
+        munmap(map, statbuf.st_size);
+        return;
+    }
+    graph->map = map;
+    graph->map_size = statbuf.st_size;
+    graph->records = (struct commit_graph_record *)(header + 1);
+    graph->num_sorted = header->num_sorted;
+    graph->num_records = num_records;
+    int num_tail = num_records - graph->num_sorted;
+    graph->tail = malloc((num_tail + 1) * sizeof(struct commit_graph_record *));
+    for(int i = 0; i < num_tail; i++) {
+        graph->tail[i] = &graph->records[graph->num_sorted + i];
+    }
+    qsort(graph->tail, num_tail, sizeof(struct commit_graph_record *), compare_commit_graph_tail);
+}
+
+void close_commit_graph(struct commit_graph *graph) {
+    if(graph->map) munmap(graph->map, graph->map_size);
+    free(graph->tail);
+    memset(graph, 0, sizeof(struct commit_graph));
+}
+
+struct commit_graph_record *lookup_commit_graph(struct commit_graph *graph, unsigned char *commit) {
+    if(graph->map == NULL) return NULL;
+    struct commit_graph_record *record = bsearch(commit, graph->records, graph->num_sorted,
+                                                 sizeof(struct commit_graph_record), compare_commit_graph_records);
+    if(record) return record;
+    struct commit_graph_record **tail_record = bsearch(commit, graph->tail, graph->num_records - graph->num_sorted,
+                                                       sizeof(struct commit_graph_record *), compare_commit_graph_tail_key);
+    return tail_record ? *tail_record : NULL;
+}
+
+// Follow a record's parent link, falling back to a lookup when the parent is
+// outside the sorted records
+struct commit_graph_record *commit_graph_parent(struct commit_graph *graph, struct commit_graph_record *record) {
+    unsigned int position = record->parent_position;
+    if(record >= graph->records && record < graph->records + graph->num_sorted
+       && position < graph->num_sorted && memcmp(graph->records[position].commit, record->parent, 20) == 0) {
+        return &graph->records[position];
+    }
+    return lookup_commit_graph(graph, record->parent);
+}
+
+// Fill in a record by diffing the commit's tree against its parent's
+void compute_commit_graph_record(char *commit_hash, struct commit_graph_record *record) {
+    char parent_hash[41];
+    char grandparent_hash[41];
+    char tree_hash[41];
+    char parent_tree_hash[41];
+    struct path_bloom bloom = {{0}, 0};
+    read_commit_links(commit_hash, parent_hash, tree_hash);
+    hex_to_hash(commit_hash, record->commit);
+    memset(record->parent, 0, 20);
+    record->parent_position = COMMIT_GRAPH_NO_POSITION;
+    if(strcmp(parent_hash, "root") == 0) {
+        tree_diff(NULL, tree_hash, "", &bloom);
+    } else {
+        hex_to_hash(parent_hash, record->parent);
+        read_commit_links(parent_hash, grandparent_hash, parent_tree_hash);
+        tree_diff(parent_tree_hash, tree_hash, "", &bloom);
+    }
+    memcpy(record->bloom, bloom.bits, BLOOM_BYTES);
+}
+
+// Open-addressing set of raw hashes. SHA-1 output is uniform, so the leading
+// bytes serve as the slot and the all-zero hash marks an empty one.
+struct hash_set {
+    unsigned char (*slots)[20];
+    size_t capacity;
+    size_t count;
+};
+
+void hash_set_init(struct hash_set *set) {
+    set->capacity = 1024;
+    set->count = 0;
+    set->slots = calloc(set->capacity, sizeof(*set->slots));
+}
+
+// Returns 1 if hash was already in the set
+int hash_set_insert(struct hash_set *set, unsigned char *hash) {
+    if((set->count + 1) * 2 > set->capacity) {
+        struct hash_set grown = { calloc(set->capacity * 2, sizeof(*set->slots)), set->capacity * 2, 0 };
+        unsigned char zero_hash[20] = {0};
+        for(size_t i = 0; i < set->capacity; i++) {
+            if(memcmp(set->slots[i], zero_hash, 20) != 0) hash_set_insert(&grown, set->slots[i]);
+        }
+        free(set->slots);
+        *set = grown;
+    }
+    unsigned long long key;
+    memcpy(&key, hash, sizeof(key));
+    size_t slot = key & (set->capacity - 1);
+    unsigned char zero_hash[20] = {0};
+    while(memcmp(set->slots[slot], zero_hash, 20) != 0) {
+        if(memcmp(set->slots[slot], hash, 20) == 0) return 1;
+        slot = (slot + 1) & (set->capacity - 1);
+    }
+    memcpy(set->slots[slot], hash, 20);
+    set->count++;
+    return 0;
+}
+
+// Rebuild the graph from every commit reachable from a ref, reusing records
+// already in the old graph, and write it back fully sorted. Returns 0 without
+// doing anything if another process holds the graph's lock.
+int write_commit_graph() {
+    char *lock_path = COMMIT_GRAPH_PATH ".lock";
+    FILE *lock = try_lock_file(lock_path);
+    if(lock == NULL) return 0;
+    struct commit_graph old_graph;
+    struct hash_set seen;
+    open_commit_graph(&old_graph);
+    hash_set_init(&seen);
+    size_t capacity = 1024;
+    struct commit_graph_record *records = malloc(capacity * sizeof(struct commit_graph_record));
+    int num_records = 0;
+    int num_computed = 0;
+    size_t stack_capacity = 64;
+    unsigned char (*stack)[20] = malloc(stack_capacity * sizeof(*stack));
+    int stack_len = 0;
+    int num_refs;
+    struct ref_entry *refs = read_refs(&num_refs);
+    for(int i = 0; i < num_refs; i++) {
+        if(strcmp(refs[i].value, "root") == 0) continue;
+        if(stack_len == stack_capacity) {
+            stack_capacity *= 2;
+            stack = realloc(stack, stack_capacity * sizeof(*stack));
+        }
+        hex_to_hash(refs[i].value, stack[stack_len++]);
+    }
+    free_refs(refs, num_refs);
+    unsigned char zero_hash[20] = {0};
+    while(stack_len > 0) {
+        unsigned char commit[20];
+        memcpy(commit, stack[--stack_len], 20);
+        if(hash_set_insert(&seen, commit)) continue;
+        if(num_records == capacity) {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(struct commit_graph_record));
+        }
+        struct commit_graph_record *cached = lookup_commit_graph(&old_graph, commit);
+        if(cached) {
+            records[num_records] = *cached;
+        } else {
+            char commit_hash[41];
+            char commit_path[128];
+            hash_to_hex(commit, 20, commit_hash);
+            create_object_path(commit_hash, commit_path);
+            // Missing commits are fsck's business, leave them out of the graph
+            if(access(commit_path, F_OK) == -1) continue;
+            compute_commit_graph_record(commit_hash, &records[num_records]);
+            num_computed++;
+        }
+        if(memcmp(records[num_records].parent, zero_hash, 20) != 0) {
+            if(stack_len == stack_capacity) {
+                stack_capacity *= 2;
+                stack = realloc(stack, stack_capacity * sizeof(*stack));
+            }
+            memcpy(stack[stack_len++], records[num_records].parent, 20);
+        }
+        num_records++;
+    }
+    close_commit_graph(&old_graph);
+    qsort(records, num_records, sizeof(struct commit_graph_record), compare_commit_graph_records);
+    for(int i = 0; i < num_records; i++) {
+        struct commit_graph_record *parent = bsearch(records[i].parent, records, num_records,
+                                                     sizeof(struct commit_graph_record), compare_commit_graph_records);
+        records[i].parent_position = parent ? parent - records : COMMIT_GRAPH_NO_POSITION;
+    }
+    struct commit_graph_header header = { COMMIT_GRAPH_MAGIC, num_records, 0 };
+    if(fwrite(&header, sizeof(header), 1, lock) != 1
+       || fwrite(records, sizeof(struct commit_graph_record), num_records, lock) != num_records) {
+        rollback_lock_file(lock, lock_path);
+        printf("ERROR -- Error writing %s\n", lock_path);
+        exit(1);
+    }
+    commit_lock_file(lock, lock_path, COMMIT_GRAPH_PATH);
+    printf("INFO -- Wrote %d commits to %s (%d computed)\n", num_records, COMMIT_GRAPH_PATH, num_computed);
+    free(stack);
+    free(records);
+    free(seen.slots);
+    return 1;
+}
+
+// Append a freshly written commit to the unsorted tail of the graph. A single
+// O_APPEND write per record keeps concurrent committers from interleaving.
+// Commits that can't be appended are read from their objects until the next
+// refresh.
+void append_commit_graph(char *commit_hash) {
+    struct commit_graph_record record;
+    compute_commit_graph_record(commit_hash, &record);
+    // Create the graph with its header under the lock and rename it into
+    // place, so appends never race with the header write
+    if(access(COMMIT_GRAPH_PATH, F_OK) == -1) {
+        char *lock_path = COMMIT_GRAPH_PATH ".lock";
+        FILE *lock = try_lock_file(lock_path);
+        if(lock == NULL) return;
+        if(access(COMMIT_GRAPH_PATH, F_OK) != -1) {
+            rollback_lock_file(lock, lock_path);
+        } else {
+            struct commit_graph_header header = { COMMIT_GRAPH_MAGIC, 0, 0 };
+            if(fwrite(&header, sizeof(header), 1, lock) != 1) {
+                rollback_lock_file(lock, lock_path);
+                printf("ERROR -- Error writing %s\n", lock_path);
+                return;
+            }
+            commit_lock_file(lock, lock_path, COMMIT_GRAPH_PATH);
+        }
+    }
+    int fd = open(COMMIT_GRAPH_PATH, O_RDWR | O_APPEND);
+    if(fd == -1) {
+        printf("ERROR -- Error opening %s\n", COMMIT_GRAPH_PATH);
+        return;
+    }
+    // Don't append behind a torn header or record, every later record would be misaligned
+    struct stat statbuf;
+    if(fstat(fd, &statbuf) == -1 || statbuf.st_size < sizeof(struct commit_graph_header)
+       || (statbuf.st_size - sizeof(struct commit_graph_header)) % sizeof(struct commit_graph_record) != 0) {
+        printf("WARNING -- %s is damaged, run tig --commit-graph to rebuild it\n", COMMIT_GRAPH_PATH);
+        close(fd);
+        return;
+    }
+    struct commit_graph_header header;
+    if(pread(fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, COMMIT_GRAPH_MAGIC, 8) != 0) {
+        printf("WARNING -- %s is damaged, run tig --commit-graph to rebuild it\n", COMMIT_GRAPH_PATH);
+        close(fd);
+        return;
+    }
+    if(write(fd, &record, sizeof(record)) != sizeof(record)) {
+        printf("ERROR -- Error appending to %s\n", COMMIT_GRAPH_PATH);
+    }
+    close(fd);
+    // Lookups in the unsorted tail cost binary searches where sorted records
+    // link straight to their parent, so re-sort once the tail grows too large
+    long num_tail = (statbuf.st_size - sizeof(struct commit_graph_header)) / sizeof(struct commit_graph_record)
+                    + 1 - header.num_sorted;
+    if(num_tail >= COMMIT_GRAPH_MAX_TAIL && num_tail > header.num_sorted / 16) {
+        write_commit_graph();
+    }
+}
@@ -18,52 +18,72 @@ void create_commit(char *message, char *commit_hash) {
     generate_timestamp(timestamp, sizeof(timestamp));
     // Read head commit hash
     read_ref("tig/HEAD", head_ref, sizeof(head_ref));
-    read_ref(head_ref, head_hash, sizeof(head_hash));
+    if(!resolve_ref(head_ref, head_hash, sizeof(head_hash))) {
+        printf("ERROR -- Unable to resolve HEAD ref %s\n", head_ref);
+        exit(1);
+    }
     // Write commit object (including head commit hash)
     sprintf(message_content, message_template, head_hash, tree_hash, name, timestamp, message);
     write_object("commit", message_content, commit_hash);
-    // Update head to new commit hash
-    write_ref(head_ref, commit_hash); 
+    // Update head to new commit hash, failing if another commit landed meanwhile
+    update_ref(head_ref, commit_hash, head_hash);
+    append_commit_graph(commit_hash);
 }
 
 void create_branch(char *name) {
     // Really just need to make a ref file that points to the head hash
-    char head_ref[64];
+    char head_ref[512];
     char head_hash[41];
-    char ref_path[64] = "tig/refs/";
+    char ref_path[strlen(REFS_DIR) + strlen(name) + 1];
+    size_t name_len = strlen(name);
+    if(name_len == 0 || name[0] == '.' || strchr(name, '/') || strchr(name, ' ')
+       || (name_len > 5 && strcmp(name + name_len - 5, ".lock") == 0)) {
+        printf("ERROR -- Invalid branch name %s\n", name);
+        exit(1);
+    }
     // Get head ref
     read_ref("tig/HEAD", head_ref, sizeof(head_ref));
     //Get head hash
-    read_ref(head_ref, head_hash, sizeof(head_hash));
-    // Write head hash to new file
-    strcat(ref_path, name);
-    write_ref(ref_path, head_hash);
+    resolve_ref(head_ref, head_hash, sizeof(head_hash));
+    // Write head hash to new ref, refusing to clobber an existing branch
+    sprintf(ref_path, "%s%s", REFS_DIR, name);
+    char existing_hash[41];
+    if(resolve_ref(ref_path, existing_hash, sizeof(existing_hash))) {
+        printf("ERROR -- Branch %s already exists\n", name);
+        exit(1);
+    }
+    update_ref(ref_path, head_hash, "");
 }
 
 void switch_branch(char *name) {
     printf("WARNING -- Switching branch. Uncommitted changes will be lost\n");
-    struct stat statbuf;
-    char ref_path[64] = "tig/refs/";
-    strcat(ref_path, name);
-    if(stat(ref_path, &statbuf) != 0) {
-        printf("ERROR -- Specified branch name does not exist %s\n", name);
-    }
+    char ref_path[strlen(REFS_DIR) + strlen(name) + 1];
     char commit_hash[41];
     char commit_path[128];
     char tree_hash[41];
-    read_ref(ref_path, commit_hash, sizeof(commit_hash));
+    sprintf(ref_path, "%s%s", REFS_DIR, name);
+    if(!resolve_ref(ref_path, commit_hash, sizeof(commit_hash))) {
+        printf("ERROR -- Specified branch name does not exist %s\n", name);
+        exit(1);
+    }
     create_object_path(commit_hash, commit_path);
     parse_file_from_prefix(commit_path, "tree ", tree_hash);
     write_work_directory(tree_hash, ".");
-    write_ref("tig/HEAD", ref_path);
+    update_ref("tig/HEAD", ref_path, NULL);
 }
 
-void enumerate_commits(char *commit_hash) {
+void print_commit(char *commit_hash) {
     char commit_path[128];
     create_object_path(commit_hash, commit_path);
     char *commit_content = read_to_buffer(commit_path);
     printf("%.6s\n================================================\n%s\n", commit_hash, commit_content);
     free(commit_content);
+}
+
+void enumerate_commits(char *commit_hash) {
+    char commit_path[128];
+    create_object_path(commit_hash, commit_path);
+    print_commit(commit_hash);
     char parent_hash[41];
     parse_file_from_prefix(commit_path, "parent ", parent_hash);
     if(strncmp(parent_hash, "root", 4) == 0) return;
@@ -71,25 +91,73 @@ void enumerate_commits(char *commit_hash) {
 }
 
 void print_commit_history(char *branch_name) {
-    char ref_path[128];
+    char ref_path[strlen(REFS_DIR) + strlen(branch_name) + 1];
     char commit_hash[41];
-    sprintf(ref_path, "tig/refs/%s", branch_name);
-    read_ref(ref_path, commit_hash, sizeof(commit_hash));
+    sprintf(ref_path, "%s%s", REFS_DIR, branch_name);
+    if(!resolve_ref(ref_path, commit_hash, sizeof(commit_hash))) {
+        printf("ERROR -- Specified branch name does not exist %s\n", branch_name);
+        exit(1);
+    }
     enumerate_commits(commit_hash);
 }
 
+// Like print_commit_history but only shows commits that changed path. The
+// commit graph supplies parents and bloom filters, so commits whose filter
+// rules the path out are skipped without opening any objects.
+void print_path_history(char *branch_name, char *path) {
+    char ref_path[strlen(REFS_DIR) + strlen(branch_name) + 1];
+    char commit_hash[41];
+    sprintf(ref_path, "%s%s", REFS_DIR, branch_name);
+    if(!resolve_ref(ref_path, commit_hash, sizeof(commit_hash))) {
+        printf("ERROR -- Specified branch name does not exist %s\n", branch_name);
+        exit(1);
+    }
+    char clean_path[strlen(path) + 1];
+    strcpy(clean_path, path);
+    normalize_path(clean_path);
+    struct commit_graph graph;
+    open_commit_graph(&graph);
+    // Walk raw hashes and only spell them out in hex for commits that need
+    // their objects opened
+    unsigned char commit[20];
+    unsigned char zero_hash[20] = {0};
+    int at_root = strcmp(commit_hash, "root") == 0;
+    if(!at_root) hex_to_hash(commit_hash, commit);
+    struct commit_graph_record *record = at_root ? NULL : lookup_commit_graph(&graph, commit);
+    while(!at_root) {
+        if(record) {
+            if(bloom_maybe_contains(record->bloom, clean_path)) {
+                hash_to_hex(commit, 20, commit_hash);
+                if(path_changed_in_commit(commit_hash, clean_path)) print_commit(commit_hash);
+            }
+            at_root = memcmp(record->parent, zero_hash, 20) == 0;
+            memcpy(commit, record->parent, 20);
+            if(!at_root) record = commit_graph_parent(&graph, record);
+        } else {
+            // Not in the graph yet, read the commit itself
+            char parent_hash[41];
+            char tree_hash[41];
+            hash_to_hex(commit, 20, commit_hash);
+            read_commit_links(commit_hash, parent_hash, tree_hash);
+            if(path_changed_in_commit(commit_hash, clean_path)) print_commit(commit_hash);
+            at_root = strcmp(parent_hash, "root") == 0;
+            if(!at_root) {
+                hex_to_hash(parent_hash, commit);
+                record = lookup_commit_graph(&graph, commit);
+            }
+        }
+    }
+    close_commit_graph(&graph);
+}
+
 void print_branches() {
-    struct dirent *files;    
-    DIR *ref_dir = opendir_safe("tig/refs");
+    int num_refs;
+    struct ref_entry *refs = read_refs(&num_refs);
     printf("Branch\tCommit\n===============\n");
-    while((files = readdir(ref_dir)) != NULL) {
-        if(strcmp(files->d_name, ".") == 0 || strcmp(files->d_name, "..") == 0) continue;
-        char commit_hash[41];
-        char filepath[128];
-        sprintf(filepath, "tig/refs/%s", files->d_name);
-        read_ref(filepath, commit_hash, sizeof(commit_hash));
-        printf("%s\t%.6s\n", files->d_name, commit_hash);
+    for(int i = 0; i < num_refs; i++) {
+        printf("%s\t%.6s\n", refs[i].name, refs[i].value);
     }
+    free_refs(refs, num_refs);
 }
 
 void find_object_hash(char *tree_hash, char * target, char *target_hash) {
@@ -128,7 +196,7 @@ void print_diff(char *filepath) {
     char head_commit_path[256];
     char tree_hash[41];
     read_ref("tig/HEAD", head_ref, sizeof(head_ref));
-    read_ref(head_ref, head_commit_hash, sizeof(head_commit_hash));
+    resolve_ref(head_ref, head_commit_hash, sizeof(head_commit_hash));
     create_object_path(head_commit_hash, head_commit_path);
     parse_file_from_prefix(head_commit_path, "tree ", tree_hash);
     char *filename = strrchr(filepath, '/');
@@ -149,14 +217,94 @@ void print_diff(char *filepath) {
     free(patch);
 }
 
+// Delete loose objects unreachable from any ref once they are older than
+// expire_seconds, so freshly written objects of an in-flight commit survive
+void collect_garbage(long expire_seconds, int repack) {
+    struct object_list objects;
+    list_objects(&objects);
+    unsigned long *reachable = bitmap_new(objects.count);
+    int missing = mark_reachable_objects(&objects, reachable);
+    if(missing > 0) {
+        printf("ERROR -- %d reachable objects are missing, refusing to prune\n", missing);
+        exit(1);
+    }
+    time_t cutoff = time(NULL) - expire_seconds;
+    int num_reachable = 0;
+    int num_pruned = 0;
+    for(int i = 0; i < objects.count; i++) {
+        if(bitmap_test(reachable, i)) {
+            num_reachable++;
+            continue;
+        }
+        char path[128];
+        struct stat statbuf;
+        create_object_path(objects.hashes[i], path);
+        if(stat(path, &statbuf) == -1 || statbuf.st_mtime > cutoff) continue;
+        if(remove(path) != 0) {
+            printf("ERROR -- Error removing object %s\n", path);
+            continue;
+        }
+        num_pruned++;
+    }
+    printf("INFO -- %d objects, %d reachable, %d pruned\n", objects.count, num_reachable, num_pruned);
+    if(repack) {
+        // Objects are stored loose, so repacking folds refs into packed-refs
+        // and drops the fan-out directories pruning emptied
+        pack_refs();
+        for(int i = 0; i < 256; i++) {
+            char dirpath[32];
+            sprintf(dirpath, "tig/objects/%02x", i);
+            rmdir(dirpath);
+        }
+    }
+    free(reachable);
+    free_object_list(&objects);
+}
+
+void check_repository() {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct object_list objects;
+    list_objects(&objects);
+    size_t bytes;
+    char **types = calloc(objects.count + 1, sizeof(char *));
+    int problems = fsck_objects(&objects, types, &bytes);
+    int num_refs;
+    struct ref_entry *refs = read_refs(&num_refs);
+    for(int i = 0; i < num_refs; i++) {
+        if(strcmp(refs[i].value, "root") == 0) continue;
+        int pos = find_object_position(&objects, refs[i].value);
+        if(pos == -1) {
+            printf("ERROR -- Branch %s points at missing commit %s\n", refs[i].name, refs[i].value);
+            problems++;
+        } else if(types[pos] && strcmp(types[pos], "commit") != 0) {
+            printf("ERROR -- Branch %s points at %s %s, not a commit\n", refs[i].name, types[pos], refs[i].value);
+            problems++;
+        }
+    }
+    free_refs(refs, num_refs);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if(seconds <= 0) seconds = 1e-9;
+    double megabytes = bytes / (1024.0 * 1024.0);
+    printf("INFO -- Checked %d objects (%.1f MB) in %.2fs, %.0f objects/s, %.1f MB/s\n",
+           objects.count, megabytes, seconds, objects.count / seconds, megabytes / seconds);
+    free(types);
+    free_object_list(&objects);
+    if(problems > 0) {
+        printf("ERROR -- Found %d problems\n", problems);
+        exit(1);
+    }
+}
+
 void initialize_repository() {
     char hash[41];
     mkdir_safe("tig", 0);
     mkdir_safe("tig/objects", 0);
     mkdir_safe("tig/refs", 0);
-    write_ref("tig/refs/master", "root\n");
+    update_ref("tig/refs/master", "root", "");
     write_config();
-    write_ref("tig/HEAD", "tig/refs/master\n");
+    update_ref("tig/HEAD", "tig/refs/master", NULL);
     create_commit("init", hash);
     printf("INFO -- Repository initialized with commit hash %s\n", hash);
 }
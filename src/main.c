@@ -1,7 +1,11 @@
 #include <getopt.h>
 #include <stdio.h>
+#include <errno.h>
+#include <string.h>
 #include "porcelain.h"
 
+#define GC_DEFAULT_EXPIRE (14 * 24 * 60 * 60)
+
 void print_help() {
     printf("Usage: tig [options]\n");
     printf("Options:\n");
@@ -9,8 +13,15 @@ void print_help() {
     printf("  -c, --commit <message>         Create a new commit with the given message\n");
     printf("  -b, --create-branch <name>     Create a new branch with the given name\n");
     printf("  -s, --switch-branch <name>     Switch to the branch with the given name\n");
-    printf("  -x, --commit-history <name>    Show the commit history for the given branch\n");
+    printf("  -x, --commit-history <name> [-- <path>]\n");
+    printf("                                 Show the commit history for the given branch, limited to path if given\n");
     printf("  -l, --list-branch              Show the list of branches with latest commit hashes\n");
+    printf("  -p, --pack-refs                Pack all branch refs into tig/packed-refs\n");
+    printf("  -g, --gc                       Prune objects unreachable from any branch\n");
+    printf("  -e, --expire <seconds>         Only prune objects older than this (default two weeks)\n");
+    printf("  -a, --repack                   Repack refs and object directories after --gc\n");
+    printf("  -f, --fsck                     Verify object hashes and links\n");
+    printf("  -G, --commit-graph             Refresh the commit graph cache used by path-limited history\n");
     printf("  -m, --merge <name>             TODO\n");
     printf("  -r, --rebase <name>            TODO\n");
     printf("  -h, --help                     Display this help message and exit\n");
@@ -23,6 +34,12 @@ int main(int argc, char **argv) {
     int switch_branch_flag = 0;
     int commit_history_flag = 0;
     int list_branch_flag = 0;
+    int pack_refs_flag = 0;
+    int gc_flag = 0;
+    int expire_flag = 0;
+    int repack_flag = 0;
+    int fsck_flag = 0;
+    int commit_graph_flag = 0;
     int merge_flag = 0;
     int rebase_flag = 0;
     int diff_flag = 0;
@@ -31,6 +48,9 @@ int main(int argc, char **argv) {
     char *commit_msg = NULL;
     char *branch_name = NULL;
     char *file_path = NULL;
+    char *history_path = NULL;
+    long expire_seconds = GC_DEFAULT_EXPIRE;
+    char *end;
     int c;
 
     struct option long_options[] = {
@@ -40,6 +60,12 @@ int main(int argc, char **argv) {
         {"switch-branch",  required_argument, 0,  's' },
         {"commit-history", required_argument, 0,  'x' },
         {"list-branch",    no_argument,       0,  'l' },
+        {"pack-refs",      no_argument,       0,  'p' },
+        {"gc",             no_argument,       0,  'g' },
+        {"expire",         required_argument, 0,  'e' },
+        {"repack",         no_argument,       0,  'a' },
+        {"fsck",           no_argument,       0,  'f' },
+        {"commit-graph",   no_argument,       0,  'G' },
         {"merge",          required_argument, 0,  'm'},
         {"rebase",         required_argument, 0,  'r'},
         {"diff",           required_argument, 0,  'd'},
@@ -47,7 +73,7 @@ int main(int argc, char **argv) {
         {0,                0,                 0,  0   }
     };
 
-    while((c = getopt_long(argc, argv, "ic:b:s:x:lhm:r:d:", long_options, NULL)) != -1) {
+    while((c = getopt_long(argc, argv, "+ic:b:s:x:lpge:afGhm:r:d:", long_options, NULL)) != -1) {
         switch(c) {
             case 'i':
                 init_flag = 1;
@@ -71,6 +97,30 @@ int main(int argc, char **argv) {
             case 'l':
                 list_branch_flag = 1; 
                 break;
+            case 'p':
+                pack_refs_flag = 1;
+                break;
+            case 'g':
+                gc_flag = 1;
+                break;
+            case 'e':
+                expire_flag = 1;
+                errno = 0;
+                expire_seconds = strtol(optarg, &end, 10);
+                if(errno != 0 || end == optarg || *end != '\0' || expire_seconds < 0) {
+                    printf("ERROR -- Invalid --expire value %s, expected a number of seconds\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'a':
+                repack_flag = 1;
+                break;
+            case 'f':
+                fsck_flag = 1;
+                break;
+            case 'G':
+                commit_graph_flag = 1;
+                break;
             case 'r':
                 rebase_flag = 1;
                 branch_name = optarg;
@@ -92,6 +142,22 @@ int main(int argc, char **argv) {
         }
     }
 
+    if((expire_flag || repack_flag) && !gc_flag) {
+        printf("ERROR -- --expire and --repack can only be used with --gc\n");
+        exit(1);
+    }
+
+    // A single path after "--" limits --commit-history, anything else left
+    // over is a mistake
+    if(optind < argc) {
+        if(!commit_history_flag || strcmp(argv[optind - 1], "--") != 0 || optind != argc - 1) {
+            printf("ERROR -- Unexpected argument %s\n", argv[optind]);
+            print_help();
+            exit(1);
+        }
+        history_path = argv[optind];
+    }
+
     if(init_flag) {
         initialize_repository();
     } else if(commit_flag) {
@@ -102,9 +168,24 @@ int main(int argc, char **argv) {
     } else if(switch_branch_flag) {
         switch_branch(branch_name);
     } else if(commit_history_flag) {
-        print_commit_history(branch_name);
+        if(history_path) {
+            print_path_history(branch_name, history_path);
+        } else {
+            print_commit_history(branch_name);
+        }
     } else if(list_branch_flag) {
         print_branches();
+    } else if(pack_refs_flag) {
+        pack_refs();
+    } else if(gc_flag) {
+        collect_garbage(expire_seconds, repack_flag);
+    } else if(fsck_flag) {
+        check_repository();
+    } else if(commit_graph_flag) {
+        if(!write_commit_graph()) {
+            printf("ERROR -- Lock file %s.lock exists, another tig process may be running\n", COMMIT_GRAPH_PATH);
+            exit(1);
+        }
     } else if(help_flag) {
         print_help();
     } else if(diff_flag) {